@@ -7,18 +7,31 @@ command history via "history"
 display current directory via "cwd"
 change directory via "cd"
 echo text via "echo"
+runtime counters via "stats", also exported to a file with "-s file"
 exiting this shell via "bye" (using "exit" will exit the outer shell this shell runs in)
+running a command string via "-c string" or a script file named on the command line
 piping of an arbitrary number of commands via "|"
 redirection of input via "<" and output via ">"
+fanout of output to several files and the next pipe via "cmd > a > b | next"
+command substitution via "$(command)", which may be nested
+command lists via ";", "&&" and "||", with the last exit status in "$?"
 */
 
+#define _GNU_SOURCE //tee() and splice()
+
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <ctype.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <time.h>
 #include <sys/param.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "psush.h"
 
@@ -27,12 +40,23 @@ redirection of input via "<" and output via ">"
 #define HIST 15
 #define READ 0
 #define WRITE 1
+#define FANOUT_PIPE_SZ (1024 * 1024)
+#define FANOUT_BUF_LEN (1024 * 1024)
+#define STAT_ADD(_F,_N) __atomic_add_fetch(&stats->_F, (_N), __ATOMIC_RELAXED)
+#define STAT_SUB(_F,_N) __atomic_sub_fetch(&stats->_F, (_N), __ATOMIC_RELAXED)
 
 
 //globals
 unsigned short is_verbose = 0;
 char *hist[HIST] = {0};
 pid_t child_pid = 0;
+pid_t shell_pid = 0;
+int last_status = EXIT_SUCCESS;
+char *stats_path = NULL;
+char *cmd_string = NULL;
+char *script_path = NULL;
+stats_t local_stats = {0};
+stats_t *stats = &local_stats;
 
 int 
 main( int argc, char *argv[] )
@@ -43,8 +67,10 @@ main( int argc, char *argv[] )
       printf("failed to catch SIGINT signal\n");
 
     memset(hist, 0, sizeof(hist));
+    shell_pid = getpid();
 
     simple_argv(argc, argv);
+    stats_init(stats_path);
     ret = process_user_input_simple();
 
     //free the command history memory
@@ -57,15 +83,31 @@ int
 process_user_input_simple(void)
 {
     char str[MAX_STR_LEN] = {'\0'};
-    char *ret_val = NULL;
-    char *raw_cmd = NULL;
+    char *line = NULL;
+    size_t line_size = 0;
     cmd_list_t *cmd_list = NULL;
-    int cmd_count = 0;
     char prompt[PROMPT_LEN] = {'\0'};
     char hostname[HOSTNAME_LEN] = {'\0'};
     char *cwd = NULL;
-    int saved_stdin = 0;
-    int saved_stdout = 0;
+    FILE *in = stdin;
+    int script_mode = 0;
+    struct stat in_stat;
+    cmd_list_t *lists = NULL;
+
+    //input comes from -c, a script file or stdin, in that order
+    if (cmd_string)
+        in = fmemopen(cmd_string, strlen(cmd_string), "r");
+    else if (script_path)
+        in = fopen(script_path, "re");
+    if (NULL == in) {
+        fprintf(stderr, "cannot read %s (line %d)\n"
+                , (cmd_string ? "-c string" : script_path), __LINE__);
+        return(EXIT_FAILURE);
+    }
+    //looking ahead for the last line blocks until more input arrives, so
+    //only do it for -c and regular files, never a pipe or a terminal.
+    script_mode = (cmd_string != NULL
+                   || (0 == fstat(fileno(in), &in_stat) && S_ISREG(in_stat.st_mode)));
 
     for ( ; ; ) {
         //create user prompt
@@ -76,29 +118,29 @@ process_user_input_simple(void)
         if (cwd) free(cwd);
 
         //only display prompt if output device is a tty (terminal)
-        if (isatty(STDOUT_FILENO))
+        if (isatty(STDOUT_FILENO) && in == stdin)
            fputs(prompt, stdout);
-        memset(str, 0, MAX_STR_LEN);
-        ret_val = fgets(str, MAX_STR_LEN, stdin);
-
-        if (NULL == ret_val) {
+        // getline() grows line as needed, so a line can hold any number
+        // of commands.
+        if (getline(&line, &line_size, in) < 0) {
             // end of input, a control-D was pressed.
             // Bust out of the input loop and go home.
             break;
         }
+        STAT_ADD(lines_read, 1);
 
-        // STOMP on the pesky trailing newline returned from fgets().
-        if (str[strlen(str) - 1] == '\n') {
+        // STOMP on the pesky trailing newline returned from getline().
+        if (line[strlen(line) - 1] == '\n') {
             // replace the newline with a NULL
-            str[strlen(str) - 1] = '\0';
+            line[strlen(line) - 1] = '\0';
         }
-        if (strlen(str) == 0) {
+        if (strlen(line) == 0) {
             // An empty command line.
-            // Just jump back to the promt and fgets().
+            // Just jump back to the promt and getline().
             continue;
         }
 
-        if (strcmp(str, BYE_CMD) == 0) {
+        if (strcmp(line, BYE_CMD) == 0) {
             // Pickup your toys and go home. I just hope there are not
             // any memory leaks. ;-)
             break;
@@ -108,22 +150,217 @@ process_user_input_simple(void)
         if (HIST - 1) free(hist[HIST - 1]); //free oldest item
         for (int i = HIST - 2; i >= 0; --i) //shift by 1
            hist[i + 1] = hist[i];
-        hist[0] = strdup(str); //add current command
+        hist[0] = strdup(line); //add current command
+
+
+        // Pipelines are separated by ";", "&&" and "||", and their
+        // commands are pipe delimited. The whole line is split up once.
+        lists = build_cmd_lists(line);
+
+        // Nothing runs after the last line of a script, so its final
+        // command can replace the shell instead of being forked.
+        if (lists && script_mode && at_end_of_input(in)) {
+            for (cmd_list = lists; cmd_list->next; cmd_list = cmd_list->next)
+                ;
+            cmd_list->tail_exec = 1;
+        }
+
+        if (run_lists(lists)) {
+            // Pickup your toys and go home.
+            break;
+        }
+    }
+
+    free(line);
+    if (in != stdin) fclose(in);
+    return(last_status);
+}
+
+//run each pipeline in lists in turn, skipping those whose "&&" or "||"
+//does not match the exit status so far. lists is freed as it goes.
+//returns non-zero if a "bye" command was run
+int
+run_lists(cmd_list_t *lists)
+{
+    cmd_list_t *cmd_list = NULL;
+    int saved_stdin = 0;
+    int saved_stdout = 0;
+    int run = 1;
+    int bye = 0;
+
+    // Each pipeline is freed once it is done with, so the one running
+    // is always the head of what is left. A child that frees its
+    // cmd_list before exiting then frees everything.
+    while (lists) {
+        cmd_list = lists;
+
+        if (run) {
+            //save stdout and stdin in case they are redirected in parse function.
+            //close-on-exec keeps them out of a command exec'd in place.
+            saved_stdout = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+            saved_stdin = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 0);
+
+            // Now that I have a linked list of the pipe delimited commands,
+            // go through each individual command.
+            if (parse_commands(cmd_list) < 0) {
+                last_status = EXIT_FAILURE;
+            }
+            else if (cmd_list->head->cmd && 0 == strcmp(cmd_list->head->cmd, BYE_CMD)) {
+                bye = 1;
+            }
+            else {
+                // This is a really good place to call a function to exec the
+                // the commands just parsed from the user's command line.
+                exec_commands(cmd_list);
+            }
+
+            //restore stdout and stdin from any redirected state. builtin
+            //output still in the stdio buffer belongs to the redirect.
+            fflush(stdout);
+            if (dup2(saved_stdout, STDOUT_FILENO) < 0)
+            {
+                fprintf(stderr, "failed to restore stdout (line %d)\n", __LINE__);
+                free_list(cmd_list);
+                cmd_list = NULL;
+                shell_exit(EXIT_FAILURE);
+            }
+            close(saved_stdout);
+            if (dup2(saved_stdin, STDIN_FILENO) < 0)
+            {
+                fprintf(stderr, "failed to restore stdin (line %d)\n", __LINE__);
+                free_list(cmd_list);
+                cmd_list = NULL;
+                shell_exit(EXIT_FAILURE);
+            }
+            close(saved_stdin);
+
+            if (bye) {
+                break;
+            }
+        }
+
+        // A skipped pipeline leaves the status alone, so in
+        // "false && a || b" the b still runs.
+        run = (cmd_list->op == LIST_SEQ
+               || (cmd_list->op == LIST_AND && 0 == last_status)
+               || (cmd_list->op == LIST_OR && 0 != last_status));
+
+        lists = cmd_list->next;
+        cmd_list->next = NULL;
+        free_list(cmd_list);
+        cmd_list = NULL;
+    }
+
+    free_list(lists); //whatever is left after a bye
+    return bye;
+}
+
+//leave on a fatal error. a forked child, such as a command substitution
+//running commands, must _exit() instead: exit() would rewind the shared
+//input fd to what the child's copy had read, and the shell would run those
+//lines again.
+void
+shell_exit(int status)
+{
+    if (getpid() == shell_pid)
+        exit(status);
+    fflush(stdout);
+    _exit(status);
+}
+
+//returns non-zero if nothing but blank lines is left in the input.
+//anything else is pushed back for the next getline().
+int
+at_end_of_input(FILE *in)
+{
+    int c;
+
+    do {
+        c = fgetc(in);
+    } while (c == '\n' || c == ' ' || c == '\t');
+    if (c == EOF) return 1;
+    ungetc(c, in);
+    return 0;
+}
+
+//split a command line into a linked list of pipelines separated by ";",
+//"&&" and "||", leaving any inside a $( ) command substitution alone.
+//the op of each pipeline says when the next one runs.
+//this function modifies line and allocates dynamic memory
+cmd_list_t *
+build_cmd_lists(char *line)
+{
+    cmd_list_t *head = NULL;
+    cmd_list_t *tail = NULL;
+    char *raw = line;
+
+    while (raw != NULL) {
+        cmd_list_t *cmd_list = NULL;
+        list_op_t op = LIST_END;
+        char *end = raw;
+
+        // A single "|" is a pipe and a single "&" is not supported,
+        // so keep looking past them.
+        while ((end = find_delim(end, LIST_DELIMS)) != NULL) {
+            if (*end == SEQ_CHAR) {
+                op = LIST_SEQ;
+                *end++ = '\0';
+                break;
+            }
+            if (end[1] == *end) {
+                op = (*end == AND_CHAR ? LIST_AND : LIST_OR);
+                *end = '\0';
+                end += 2;
+                break;
+            }
+            ++end;
+        }
+
+        cmd_list = build_cmd_list(raw);
+        if (0 == cmd_list->count) {
+            // Nothing between the operators, as after a trailing ";".
+            free_list(cmd_list);
+        }
+        else {
+            cmd_list->op = op;
+            if (NULL == head) {
+                head = tail = cmd_list;
+            }
+            else {
+                tail->next = cmd_list;
+                tail = cmd_list;
+            }
+        }
+        raw = end;
+    }
 
+    return head;
+}
+
+//split a command line into a linked list of pipe delimited commands.
+//pipes nested inside a $( ) command substitution are left alone so the
+//substitution can be run as its own pipeline later.
+//this function modifies line and allocates dynamic memory
+cmd_list_t *
+build_cmd_list(char *line)
+{
+    cmd_list_t *cmd_list = (cmd_list_t *) calloc(1, sizeof(cmd_list_t));
+    char *raw_cmd = line;
+    int cmd_count = 0;
 
-        // Basic commands are pipe delimited.
-        // This is really for Stage 2.
-        raw_cmd = strtok(str, PIPE_DELIM);
+    STAT_ADD(parse_heap_bytes, sizeof(cmd_list_t));
 
-        cmd_list = (cmd_list_t *) calloc(1, sizeof(cmd_list_t));
+    while (raw_cmd != NULL) {
+        char *end = find_delim(raw_cmd, PIPE_DELIM);
 
-        // This block should probably be put into its own function.
-        cmd_count = 0;
-        while (raw_cmd != NULL ) {
+        if (end) *end++ = '\0';
+        if (*raw_cmd) //skip empty commands, the same as strtok() would
+        {
             cmd_t *cmd = (cmd_t *) calloc(1, sizeof(cmd_t));
 
             cmd->raw_cmd = strdup(raw_cmd);
             cmd->list_location = cmd_count++;
+            STAT_ADD(parse_heap_bytes, cmd_heap_bytes(cmd));
 
             if (cmd_list->head == NULL) {
                 // An empty list.
@@ -135,47 +372,33 @@ process_user_input_simple(void)
                 cmd_list->tail = cmd;
             }
             cmd_list->count++;
-
-            // Get the next raw command.
-            raw_cmd = strtok(NULL, PIPE_DELIM);
-        }
-
-        //save stdout and stdin in case they are redirected in parse function
-        saved_stdout = dup(STDOUT_FILENO);
-        saved_stdin = dup(STDIN_FILENO);
-
-        // Now that I have a linked list of the pipe delimited commands,
-        // go through each individual command.
-        parse_commands(cmd_list);
-
-        // This is a really good place to call a function to exec the
-        // the commands just parsed from the user's command line.
-        exec_commands(cmd_list);
-
-        //restore stdout and stdin from any redirected state
-        if (dup2(saved_stdout, STDOUT_FILENO) < 0)
-        {
-            fprintf(stderr, "failed to restore stdout (line %d)\n", __LINE__);
-            free_list(cmd_list);
-            cmd_list = NULL;
-            exit(EXIT_FAILURE);
-        }
-        close(saved_stdout);
-        if (dup2(saved_stdin, STDIN_FILENO) < 0)
-        {
-            fprintf(stderr, "failed to restore stdin (line %d)\n", __LINE__);
-            free_list(cmd_list);
-            cmd_list = NULL;
-            exit(EXIT_FAILURE);
         }
-        close(saved_stdin);
+        raw_cmd = end;
+    }
 
+    return cmd_list;
+}
 
-        free_list(cmd_list);
-        cmd_list = NULL;
-    }
+//return a pointer to the first character of str found in delim that is
+//not inside a $( ) command substitution, or NULL if there is none.
+char *
+find_delim(char *str, const char *delim)
+{
+   int depth = 0;
 
-    return(EXIT_SUCCESS);
+   for (; *str; ++str)
+   {
+      if (0 == strncmp(str, SUBST_OPEN, strlen(SUBST_OPEN)))
+      {
+         ++depth;
+         str += strlen(SUBST_OPEN) - 1;
+      }
+      else if (*str == SUBST_CLOSE && depth > 0)
+         --depth;
+      else if (0 == depth && strchr(delim, *str))
+         return str;
+   }
+   return NULL;
 }
 
 void 
@@ -183,7 +406,7 @@ simple_argv(int argc, char *argv[])
 {
     int opt;
 
-    while ((opt = getopt(argc, argv, "hv")) != -1) {
+    while ((opt = getopt(argc, argv, "hvs:c:")) != -1) {
         switch (opt) {
         case 'h': //help
             fprintf(stdout, "You must be out of your Vulcan mind if you think\n"
@@ -197,6 +420,12 @@ simple_argv(int argc, char *argv[])
                         , is_verbose);
             }
             break;
+        case 'c': //run a command string instead of reading stdin
+            cmd_string = optarg;
+            break;
+        case 's': //export runtime stats to a file
+            stats_path = optarg;
+            break;
         case '?':
             fprintf(stderr, "*** Unknown option used, ignoring. ***\n");
             break;
@@ -205,6 +434,8 @@ simple_argv(int argc, char *argv[])
             break;
         }
     }
+    if (optind < argc) //script file
+        script_path = argv[optind];
 }
 
 void 
@@ -214,75 +445,67 @@ exec_commands(cmd_list_t *cmds)
     char **argv = {0};
 
     if (1 == cmds->count) {
+        int out_save = -1;
+        pid_t relay = 0;
+
         if (!cmd->cmd) return; //empty command, bail
-        if (0 == strcmp(cmd->cmd, CD_CMD)) //cd 
-        {
-            if (0 == cmd->param_count) //cd no argument
-            {
-                if (chdir(getenv("HOME")) != 0)
-                {
-                    fprintf(stderr, "cd failed (line %d)\n", __LINE__);
-                }
-            }
-            else //cd with argument
-            {
-                if (chdir(cmd->param_list->param) != 0)
-                {
-                    fprintf(stderr, "cd failed on (line %d)\n", __LINE__);
-                }
-            }
-        }
-        else if (0 == strcmp(cmd->cmd, CWD_CMD)) //cwd
+        if (cmd->output_fds) //fan output out to several files
         {
-            char str[MAXPATHLEN];
-            getcwd(str, MAXPATHLEN); 
-            printf(" " CWD_CMD ": %s\n", str);
+            int fan_w = start_fanout(cmds, cmd, -1, -1, -1, &relay);
+            if (fan_w < 0) return;
+            out_save = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+            dup2(fan_w, STDOUT_FILENO);
+            close(fan_w);
         }
-        else if (0 == strcmp(cmd->cmd, ECHO_CMD)) //echo
+        STAT_ADD(cmds_launched, 1);
+        if (exec_builtin(cmd, stdout)) //builtin commands
         {
-           param_t *current = cmd->param_list;
-           while (current)
-           {
-              fprintf(stdout, "%s", current->param);
-              if (current->next) fprintf(stdout, " ");
-              current = current->next;
-           }
-
-           fprintf(stdout, "\n");
+            STAT_ADD(builtins, 1);
         }
-        else if (0 == strcmp(cmd->cmd, HISTORY_CMD)) //display history
+        else if (cmds->tail_exec && !cmd->output_fds) //exec in place
         {
-           int num_commands = 0;
-           for (int i = 0; i < HIST; ++i)
-              if (hist[i]) ++num_commands;
-
-           //display every item in history, oldest to newest
-           for (int i = 0, j = num_commands; i < num_commands; ++i, --j)
-              fprintf(stdout, "   %d  %s\n", i + 1, hist[j - 1]);
+            argv = make_ragged(cmd);
+            fflush(stdout);
+            execvp(argv[0], argv); //execvp only returns on failure
+            fprintf(stdout, "%s: command not found\n", argv[0]);
+            last_status = EXIT_FAILURE;
+            free_ragged(argv);
         }
         else //external commands
         {
             int status = 0;
+            uint64_t start = now_usec();
             argv = make_ragged(cmd);
 
-            //fork, exec with child
+            //fork, exec with child. flush first so a child that fails to
+            //exec does not repeat buffered output
+            fflush(stdout);
             child_pid = fork();
-            if (child_pid == -1) fprintf(stderr, "fork failed (line %d)\n", __LINE__);
+            if (child_pid == -1)
+            {
+               fprintf(stderr, "fork failed (line %d)\n", __LINE__);
+               last_status = EXIT_FAILURE;
+            }
             else if (child_pid == 0) //child process
             {
+               stats_child();
                execvp(argv[0], argv); //execvp only returns on failure
                fprintf(stdout, "%s: command not found\n", argv[0]);
+               fflush(stdout);
                //cleanup memory then leave function
                free_ragged(argv);
                free_list(cmds);
                for (int i = 0; i < HIST; ++i)
                   if (hist[i]) free(hist[i]);
-               exit(EXIT_FAILURE);
+               _exit(EXIT_FAILURE);
             }
             
             else //parent process
             {
-               wait(&status);
+               stats_forked(start);
+               waitpid(child_pid, &status, 0);
+               stats_reaped();
+               last_status = exit_status(status);
                //check if child was killed by forwarded SIGINT signal
                if (WIFSIGNALED(status) && WTERMSIG(status) == SIGINT)
                   fprintf(stdout, "child killed\n");
@@ -290,16 +513,29 @@ exec_commands(cmd_list_t *cmds)
 
             free_ragged(argv);
         }
+        if (out_save >= 0) //let the relay see end of file, then reap it
+        {
+            fflush(stdout);
+            dup2(out_save, STDOUT_FILENO);
+            close(out_save);
+            waitpid(relay, NULL, 0);
+            stats_reaped();
+        }
     }
     else //multiple commands on command line
     {
         int p_trail = 0;
         int status = 0;
+        int forked = 0;
+        pid_t last_pid = 0;
 
         while (cmd)
         {
            int P[2];
+           int fan_w = -1;
            pid_t mypid = 0;
+           pid_t relay = 0;
+           uint64_t start = now_usec();
            argv = make_ragged(cmd);
 
            //create pipe if not the last command 
@@ -313,11 +549,47 @@ exec_commands(cmd_list_t *cmds)
                  free_list(cmds);
                  for (int i = 0; i < HIST; ++i)
                      if (hist[i]) free(hist[i]);
-                 exit(EXIT_FAILURE);
+                 shell_exit(EXIT_FAILURE);
+              }
+           }
+
+           //the last stage of a final pipeline replaces the shell. the
+           //stages before it are left for that program to reap.
+           if (cmds->tail_exec && !cmd->next && !cmd->output_fds)
+           {
+              dup2(p_trail, STDIN_FILENO);
+              close(p_trail);
+              STAT_ADD(cmds_launched, 1);
+              fflush(stdout);
+              execvp(argv[0], argv); //only returns on failure
+              fprintf(stdout, "%s: command not found\n", argv[0]);
+              last_status = EXIT_FAILURE;
+              free_ragged(argv);
+              break;
+           }
+
+           //fan output out to its files and the next command
+           if (cmd->output_fds)
+           {
+              //the relay must not hold the read end of its own output
+              //pipe, or the pipe into this command
+              fan_w = start_fanout(cmds, cmd, cmd->next ? P[WRITE] : -1
+                                   , cmd != cmds->head ? p_trail : -1
+                                   , cmd->next ? P[READ] : -1, &relay);
+              if (fan_w < 0)
+              {
+                 //cleanup memory then exit
+                 free_ragged(argv);
+                 free_list(cmds);
+                 for (int i = 0; i < HIST; ++i)
+                     if (hist[i]) free(hist[i]);
+                 shell_exit(EXIT_FAILURE);
               }
+              ++forked;
            }
 
-           //fork
+           //fork, flushing first so the child does not repeat buffered output
+           fflush(stdout);
            mypid = fork();
            if (mypid == -1) //error
            {
@@ -327,31 +599,42 @@ exec_commands(cmd_list_t *cmds)
               free_list(cmds);
               for (int i = 0; i < HIST; ++i)
                   if (hist[i]) free(hist[i]);
-              exit(EXIT_FAILURE);
+              shell_exit(EXIT_FAILURE);
            }
            else if (mypid == 0) //child
            {
+              stats_child();
               if (cmd != cmds->head) //not first command
               {
                  dup2(p_trail, STDIN_FILENO);  //p_trail is input side of pipe from previous command in pipeline
               }
+              if (fan_w >= 0) //output goes through the fanout relay
+              {
+                 dup2(fan_w, STDOUT_FILENO);
+                 close(fan_w);
+              }
               if (cmd->next) //not last command
               {
-                 dup2(P[WRITE], STDOUT_FILENO);
+                 if (fan_w < 0) dup2(P[WRITE], STDOUT_FILENO);
                  close(P[READ]);
                  close(P[WRITE]);
               }
               execvp(argv[0], argv); //only returns on failure
               //cleanup memory then exit
               fprintf(stdout, "%s: command not found\n", argv[0]);
+              fflush(stdout);
               free_ragged(argv);
               free_list(cmds);
               for (int i = 0; i < HIST; ++i)
                   if (hist[i]) free(hist[i]);
-              exit(EXIT_FAILURE);
+              _exit(EXIT_FAILURE);
            }
            else //parent
            {
+              stats_forked(start);
+              STAT_ADD(cmds_launched, 1);
+              ++forked;
+              if (!cmd->next) last_pid = mypid;
               if (cmd != cmds->head) //not first command
               {
                  close(p_trail);  //p_trail is input side of pipe from previous command in pipeline
@@ -361,15 +644,18 @@ exec_commands(cmd_list_t *cmds)
                  close(P[WRITE]);
                  p_trail = P[READ];
               }
+              if (fan_w >= 0) close(fan_w);
            }
            free_ragged(argv);
            cmd = cmd->next; //next command
         } //end while
 
-        //reap all children
-        for (int i = 0; i < cmds->count; ++i)
+        //reap all children, including fanout relays
+        for (int i = 0; i < forked; ++i)
         {
-            wait(&status);
+            //the pipeline's status is the status of its last command
+            if (wait(&status) == last_pid) last_status = exit_status(status);
+            stats_reaped();
             //check if child was killed by forwarded SIGINT signal
             if (WIFSIGNALED(status) && WTERMSIG(status) == SIGINT)
                fprintf(stdout, "child killed\n");
@@ -377,6 +663,560 @@ exec_commands(cmd_list_t *cmds)
     }
 }
 
+//returns non-zero if cmd names a command built into this shell
+int
+is_builtin(const char *name)
+{
+    return (0 == strcmp(name, CD_CMD) || 0 == strcmp(name, CWD_CMD)
+            || 0 == strcmp(name, ECHO_CMD) || 0 == strcmp(name, HISTORY_CMD)
+            || 0 == strcmp(name, STATS_CMD));
+}
+
+//run cmd in this process if it is a builtin, writing any output to out.
+//returns non-zero if cmd was a builtin, zero if it must be exec'd.
+int
+exec_builtin(cmd_t *cmd, FILE *out)
+{
+    if (!is_builtin(cmd->cmd)) return 0;
+    last_status = EXIT_SUCCESS;
+
+    if (0 == strcmp(cmd->cmd, CD_CMD)) //cd 
+    {
+        if (0 == cmd->param_count) //cd no argument
+        {
+            if (chdir(getenv("HOME")) != 0)
+            {
+                fprintf(stderr, "cd failed (line %d)\n", __LINE__);
+                last_status = EXIT_FAILURE;
+            }
+        }
+        else //cd with argument
+        {
+            if (chdir(cmd->param_list->param) != 0)
+            {
+                fprintf(stderr, "cd failed on (line %d)\n", __LINE__);
+                last_status = EXIT_FAILURE;
+            }
+        }
+    }
+    else if (0 == strcmp(cmd->cmd, CWD_CMD)) //cwd
+    {
+        char str[MAXPATHLEN];
+        getcwd(str, MAXPATHLEN); 
+        fprintf(out, " " CWD_CMD ": %s\n", str);
+    }
+    else if (0 == strcmp(cmd->cmd, ECHO_CMD)) //echo
+    {
+       param_t *current = cmd->param_list;
+       while (current)
+       {
+          fprintf(out, "%s", current->param);
+          if (current->next) fprintf(out, " ");
+          current = current->next;
+       }
+
+       fprintf(out, "\n");
+    }
+    else if (0 == strcmp(cmd->cmd, HISTORY_CMD)) //display history
+    {
+       int num_commands = 0;
+       for (int i = 0; i < HIST; ++i)
+          if (hist[i]) ++num_commands;
+
+       //display every item in history, oldest to newest
+       for (int i = 0, j = num_commands; i < num_commands; ++i, --j)
+          fprintf(out, "   %d  %s\n", i + 1, hist[j - 1]);
+    }
+    else if (0 == strcmp(cmd->cmd, STATS_CMD)) //display runtime stats
+    {
+       print_stats(out);
+    }
+    return 1;
+}
+
+//convert a status from wait() into a $? style exit status. a command
+//killed by a signal gets 128 plus the signal number.
+int
+exit_status(int status)
+{
+   if (WIFEXITED(status)) return WEXITSTATUS(status);
+   if (WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+   return EXIT_FAILURE;
+}
+
+//replace every $? in raw with the exit status of the last pipeline. any
+//inside a $( ) command substitution are left for when that command runs.
+//returns a dynamically allocated string
+char *
+expand_status(const char *raw)
+{
+   char *expanded = NULL;
+   size_t len = 0;
+   FILE *fp = open_memstream(&expanded, &len);
+   int depth = 0;
+
+   while (*raw)
+   {
+      if (0 == strncmp(raw, SUBST_OPEN, strlen(SUBST_OPEN)))
+      {
+         ++depth;
+         fputs(SUBST_OPEN, fp);
+         raw += strlen(SUBST_OPEN);
+      }
+      else if (0 == depth && 0 == strncmp(raw, STATUS_VAR, strlen(STATUS_VAR)))
+      {
+         fprintf(fp, "%d", last_status);
+         raw += strlen(STATUS_VAR);
+      }
+      else
+      {
+         if (*raw == SUBST_CLOSE && depth > 0) --depth;
+         fputc(*raw++, fp);
+      }
+   }
+   fclose(fp);
+
+   return expanded;
+}
+
+//run every $( ) command substitution in raw, innermost first. each one
+//is replaced by a SUBST_MARK and its output is added to outputs, so the
+//output is never tokenized as shell syntax. see split_subst().
+//returns a dynamically allocated string
+char *
+mark_subst(const char *raw, param_t **outputs)
+{
+   char *marked = NULL;
+   size_t len = 0;
+   FILE *fp = open_memstream(&marked, &len);
+   const char *start = NULL;
+   param_t *tail = NULL;
+
+   while ((start = strstr(raw, SUBST_OPEN)) != NULL)
+   {
+      const char *end = start + strlen(SUBST_OPEN);
+      int depth = 1;
+      char *text = NULL;
+      param_t *output = NULL;
+
+      //find the matching close paren, allowing nested substitutions
+      for (; *end; ++end)
+      {
+         if (0 == strncmp(end, SUBST_OPEN, strlen(SUBST_OPEN))) ++depth;
+         else if (*end == SUBST_CLOSE && 0 == --depth) break;
+      }
+      if (depth) break; //unterminated, leave the rest as plain text
+
+      fwrite(raw, 1, start - raw, fp);
+      fputc(SUBST_MARK, fp);
+      text = strndup(start + strlen(SUBST_OPEN), end - start - strlen(SUBST_OPEN));
+      output = (param_t *) calloc(1, sizeof(param_t));
+      output->param = capture_subst(text);
+      free(text);
+      if (tail) tail->next = output;
+      else *outputs = output;
+      tail = output;
+      raw = end + 1;
+   }
+   fputs(raw, fp);
+   fclose(fp);
+
+   return marked;
+}
+
+//split one token holding SUBST_MARKs into words. each mark takes the next
+//output from *subst, split on whitespace. text next to a mark joins the
+//word it touches, so "a$(echo b c)d" gives "ab" and "cd".
+//returns a dynamically allocated list of words, NULL if there are none
+param_t *
+split_subst(const char *arg, param_t **subst)
+{
+   param_t *words = NULL;
+   param_t *tail = NULL;
+   char *word = NULL;
+   size_t len = 0;
+   FILE *fp = open_memstream(&word, &len);
+   int have = 0;
+
+   for ( ; *arg; ++arg)
+   {
+      const char *text = NULL;
+
+      if (*arg != SUBST_MARK)
+      {
+         fputc(*arg, fp);
+         have = 1;
+         continue;
+      }
+      text = (*subst ? (*subst)->param : "");
+      if (*subst) *subst = (*subst)->next;
+      for ( ; *text; ++text)
+      {
+         if (!isspace((unsigned char) *text))
+         {
+            fputc(*text, fp);
+            have = 1;
+         }
+         else if (have) //end of a word
+         {
+            param_t *param = (param_t *) calloc(1, sizeof(param_t));
+
+            fclose(fp);
+            param->param = word;
+            if (tail) tail->next = param;
+            else words = param;
+            tail = param;
+            word = NULL;
+            fp = open_memstream(&word, &len);
+            have = 0;
+         }
+      }
+   }
+   fclose(fp);
+   if (have)
+   {
+      param_t *param = (param_t *) calloc(1, sizeof(param_t));
+
+      param->param = word;
+      if (tail) tail->next = param;
+      else words = param;
+   }
+   else
+      free(word);
+
+   return words;
+}
+
+//the file name for a redirect, which may come from a command substitution
+//as long as that gives exactly one word.
+//returns a dynamically allocated string, NULL if there is no single name
+char *
+subst_file_name(const char *name, param_t **subst)
+{
+   param_t *words = NULL;
+   char *file = NULL;
+
+   if (NULL == name) return NULL;
+   if (!strchr(name, SUBST_MARK)) return strdup(name);
+
+   words = split_subst(name, subst);
+   if (words && NULL == words->next)
+   {
+      file = words->param;
+      words->param = NULL;
+   }
+   free_params(words);
+
+   return file;
+}
+
+//add words from split_subst() to cmd. the first becomes the command
+//itself when there is none yet, the rest are params. frees words
+void
+append_words(cmd_t *cmd, param_t *words, param_t **ptail)
+{
+   if (words && NULL == cmd->cmd)
+   {
+      param_t *first = words;
+
+      cmd->cmd = first->param;
+      words = first->next;
+      free(first);
+   }
+   if (NULL == words) return;
+
+   if (*ptail) (*ptail)->next = words;
+   else cmd->param_list = words;
+   for ( ; words; words = words->next)
+   {
+      cmd->param_count++;
+      *ptail = words;
+   }
+}
+
+//run the command line in text and return everything it wrote to stdout.
+//echo, cwd and history run in this process with no fork.
+//this function modifies text and allocates dynamic memory
+char *
+capture_subst(char *text)
+{
+   cmd_list_t *sub = NULL;
+   char *output = NULL;
+   size_t len = 0;
+   //redirection is applied to this process by parse_commands, so only
+   //parse here when there is none. otherwise the capture child parses.
+   int parsed = !strpbrk(text, REDIR_IN REDIR_OUT);
+
+   sub = build_cmd_lists(text);
+   if (NULL == sub) return strdup("");
+   //a command list is parsed one pipeline at a time as it runs
+   if (sub->next) parsed = 0;
+   if (parsed && parse_commands(sub) < 0)
+   {
+      free_list(sub);
+      return strdup("");
+   }
+
+   if (parsed && 1 == sub->count && sub->head->cmd
+       && is_builtin(sub->head->cmd) && strcmp(sub->head->cmd, CD_CMD))
+   {
+      FILE *fp = open_memstream(&output, &len);
+      exec_builtin(sub->head, fp);
+      fclose(fp);
+      STAT_ADD(cmds_launched, 1);
+      STAT_ADD(builtins, 1);
+   }
+   else
+      output = capture_output(sub, parsed, &len);
+   free_list(sub);
+
+   if (!output) return strdup("");
+   return output;
+}
+
+//fork a child to run cmds with stdout on a pipe, and read everything it
+//writes into a buffer that doubles in size as it fills.
+//returns the dynamically allocated buffer and its length in len
+char *
+capture_output(cmd_list_t *cmds, int parsed, size_t *len)
+{
+   int P[2];
+   pid_t pid = 0;
+   size_t size = 4096;
+   char *buf = NULL;
+   ssize_t n = 0;
+   uint64_t start = now_usec();
+
+   *len = 0;
+   if (pipe(P) == -1)
+   {
+      fprintf(stderr, "pipe creation failed (line %d)\n", __LINE__);
+      return NULL;
+   }
+
+   //flush so the child does not inherit and repeat buffered output
+   fflush(stdout);
+   pid = fork();
+   if (pid == -1)
+   {
+      fprintf(stderr, "fork failed (line %d)\n", __LINE__);
+      close(P[READ]);
+      close(P[WRITE]);
+      return NULL;
+   }
+   else if (pid == 0) //child
+   {
+      cmd_list_t *last = cmds;
+
+      stats_child();
+      dup2(P[WRITE], STDOUT_FILENO);
+      close(P[READ]);
+      close(P[WRITE]);
+
+      //nothing runs after the last command, so it can replace this child
+      while (last->next) last = last->next;
+      last->tail_exec = 1;
+      if (parsed)
+      {
+         exec_commands(cmds);
+         free_list(cmds);
+      }
+      else
+         run_lists(cmds); //frees cmds
+      fflush(stdout);
+
+      //cleanup memory then exit. _exit() leaves the input stream alone;
+      //exit() would rewind the shared fd to what this copy had read, and
+      //the shell would run those lines again.
+      for (int i = 0; i < HIST; ++i)
+         if (hist[i]) free(hist[i]);
+      _exit(last_status);
+   }
+
+   //parent
+   stats_forked(start);
+   close(P[WRITE]);
+   buf = malloc(size);
+   while ((n = read(P[READ], buf + *len, size - *len - 1)) != 0)
+   {
+      if (n < 0) break;
+      *len += n;
+      if (size - *len - 1 == 0)
+      {
+         size *= 2;
+         buf = realloc(buf, size);
+      }
+   }
+   buf[*len] = '\0';
+   close(P[READ]);
+   waitpid(pid, NULL, 0);
+   stats_reaped();
+   STAT_ADD(pipe_bytes, *len);
+
+   return buf;
+}
+
+//start a relay process that copies everything written to the returned
+//fd into each of cmd's output files, and into pipe_fd when it is not -1.
+//the relay closes in_fd and peer_fd (when not -1), the other pipe ends
+//the shell holds, so a reader that exits early gives it EPIPE.
+//returns the write end of the relay's input pipe, or -1 on failure
+int
+start_fanout(cmd_list_t *cmds, cmd_t *cmd, int pipe_fd, int in_fd, int peer_fd
+             , pid_t *relay)
+{
+   int S[2];
+   uint64_t start = now_usec();
+
+   if (pipe(S) == -1)
+   {
+      fprintf(stderr, "pipe creation failed (line %d)\n", __LINE__);
+      return -1;
+   }
+
+   //flush so the relay does not inherit and repeat buffered output
+   fflush(stdout);
+   *relay = fork();
+   if (*relay == -1)
+   {
+      fprintf(stderr, "fork failed (line %d)\n", __LINE__);
+      close(S[READ]);
+      close(S[WRITE]);
+      return -1;
+   }
+   else if (*relay == 0) //relay child
+   {
+      int nfds = cmd->output_count;
+
+      //ctrl-C stops the relay with the rest of the pipeline. the shell's
+      //handler would forward it to a stale child_pid.
+      signal(SIGINT, SIG_DFL);
+      close(S[WRITE]);
+      if (in_fd >= 0) close(in_fd);
+      if (peer_fd >= 0) close(peer_fd);
+      if (pipe_fd >= 0)
+      {
+         //output_fds has room for this, see parse_commands()
+         cmd->output_fds[nfds++] = pipe_fd;
+      }
+      //the relay counts bytes into the shell's stats while it runs
+      fanout_relay(S[READ], cmd->output_fds, nfds);
+      stats_child();
+
+      //cleanup memory then exit. _exit() so the shell's input stream is
+      //not rewound, see capture_output()
+      free_list(cmds);
+      for (int i = 0; i < HIST; ++i)
+         if (hist[i]) free(hist[i]);
+      _exit(EXIT_SUCCESS);
+   }
+
+   //parent. the relay owns the output files now
+   stats_forked(start);
+   close(S[READ]);
+   for (int i = 0; i < cmd->output_count; ++i)
+   {
+      close(cmd->output_fds[i]);
+      cmd->output_fds[i] = -1;
+   }
+   return S[WRITE];
+}
+
+//copy everything read from the pipe src to every fd in fds until end of
+//file. each chunk is duplicated in the kernel with tee(2) into a scratch
+//pipe and moved on with splice(2), so the data never enters user space.
+//the last target takes the chunk straight from src, which consumes it.
+void
+fanout_relay(int src, int *fds, int nfds)
+{
+   int S[2];
+   ssize_t len = 0;
+   int size = 0;
+
+   if (pipe(S) == -1)
+   {
+      fprintf(stderr, "pipe creation failed (line %d)\n", __LINE__);
+      return;
+   }
+   //bigger pipes mean fewer trips through the loop. the scratch pipe
+   //must hold anything src does, so src only grows to match it.
+   size = fcntl(S[WRITE], F_SETPIPE_SZ, FANOUT_PIPE_SZ);
+   if (size > 0) fcntl(src, F_SETPIPE_SZ, size);
+
+   for ( ; ; )
+   {
+      //peek at the next chunk. the first target's copy lands in scratch
+      len = tee(src, S[WRITE], INT_MAX, 0);
+      if (len == 0) break; //end of file
+      if (len < 0)
+      {
+         if (errno == EINTR) continue;
+         break;
+      }
+
+      for (int i = 0; i < nfds - 1; ++i)
+      {
+         if (i > 0 && tee(src, S[WRITE], len, 0) != len)
+         {
+            fprintf(stderr, "fanout tee failed (line %d)\n", __LINE__);
+            return;
+         }
+         if (splice_all(S[READ], fds[i], len) < 0)
+         {
+            fprintf(stderr, "fanout write failed (line %d)\n", __LINE__);
+            return;
+         }
+      }
+      if (splice_all(src, fds[nfds - 1], len) < 0)
+      {
+         fprintf(stderr, "fanout write failed (line %d)\n", __LINE__);
+         return;
+      }
+      STAT_ADD(pipe_bytes, len);
+   }
+   close(S[READ]);
+   close(S[WRITE]);
+}
+
+//move len bytes from the pipe in to out. targets that splice(2) does
+//not support get a plain read/write copy through a large buffer instead.
+//returns 0 on success, -1 on error
+int
+splice_all(int in, int out, size_t len)
+{
+   static char buf[FANOUT_BUF_LEN];
+
+   while (len > 0)
+   {
+      ssize_t n = splice(in, NULL, out, NULL, len, SPLICE_F_MOVE);
+
+      if (n < 0 && errno == EINVAL)
+      {
+         n = read(in, buf, MIN(len, sizeof(buf)));
+         if (n > 0 && write_all(out, buf, n) < 0) return -1;
+      }
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) return -1;
+      len -= n;
+   }
+   return 0;
+}
+
+//write all len bytes of buf to fd. returns 0 on success, -1 on error
+int
+write_all(int fd, const char *buf, size_t len)
+{
+   while (len > 0)
+   {
+      ssize_t n = write(fd, buf, len);
+      if (n < 0 && errno == EINTR) continue;
+      if (n < 0) return -1;
+      buf += n;
+      len -= n;
+   }
+   return 0;
+}
+
 //make a null-terminated ragged array for a single command.
 //argv[0] will be the command, followed by all its parameters,
 //ending with a null ptr after the last parameter.
@@ -418,6 +1258,143 @@ free_ragged(char **argv)
    argv = NULL;
 }
 
+//map the runtime stats. with a path they go in a file that monitors can
+//mmap or read while the shell runs, otherwise in anonymous memory. either
+//way the mapping is shared, so fanout relays can add to the counters.
+void
+stats_init(const char *path)
+{
+   int fd = -1;
+   stats_t *map = NULL;
+   int flags = MAP_SHARED;
+
+   if (path)
+   {
+      fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+      if (fd >= 0 && ftruncate(fd, sizeof(stats_t)) < 0)
+      {
+         //mapping a file too short to hold the stats would SIGBUS
+         close(fd);
+         fd = -1;
+      }
+      if (fd < 0)
+         fprintf(stderr, "stats file %s failed (line %d)\n", path, __LINE__);
+   }
+   if (fd < 0) flags |= MAP_ANONYMOUS;
+
+   map = mmap(NULL, sizeof(stats_t), PROT_READ | PROT_WRITE, flags, fd, 0);
+   if (fd >= 0) close(fd);
+   if (map == MAP_FAILED)
+   {
+      fprintf(stderr, "stats mmap failed (line %d)\n", __LINE__);
+      map = &local_stats;
+   }
+
+   *map = *stats;
+   map->magic = STATS_MAGIC;
+   map->version = STATS_VERSION;
+   stats = map;
+}
+
+//called in a forked child. from here on the child counts into its own
+//copy, so its cleanup does not show up in the shell's stats.
+void
+stats_child(void)
+{
+   if (stats != &local_stats)
+   {
+      local_stats = *stats;
+      stats = &local_stats;
+   }
+}
+
+//count a child forked at start (from now_usec()) and still running
+void
+stats_forked(uint64_t start)
+{
+   uint64_t children = STAT_ADD(children, 1);
+
+   STAT_ADD(forks, 1);
+   if (children > stats->peak_children)
+      stats->peak_children = children;
+   stats_hist(stats->launch_usec, now_usec() - start);
+}
+
+//count a child that has been waited on
+void
+stats_reaped(void)
+{
+   if (stats->children > 0) STAT_SUB(children, 1);
+}
+
+//add one time in usec to a log2 histogram of STATS_BUCKETS buckets
+void
+stats_hist(uint64_t *buckets, uint64_t usec)
+{
+   int i = 0;
+
+   while (usec > 0 && i < STATS_BUCKETS - 1)
+   {
+      usec >>= 1;
+      ++i;
+   }
+   __atomic_add_fetch(&buckets[i], 1, __ATOMIC_RELAXED);
+}
+
+//monotonic clock in microseconds
+uint64_t
+now_usec(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+//number of heap bytes held by cmd and everything it points to
+uint64_t
+cmd_heap_bytes(cmd_t *cmd)
+{
+   uint64_t bytes = sizeof(cmd_t);
+   param_t *param = NULL;
+
+   if (cmd->raw_cmd) bytes += strlen(cmd->raw_cmd) + 1;
+   if (cmd->cmd) bytes += strlen(cmd->cmd) + 1;
+   if (cmd->input_file_name) bytes += strlen(cmd->input_file_name) + 1;
+   if (cmd->output_file_name) bytes += strlen(cmd->output_file_name) + 1;
+   if (cmd->output_fds) bytes += sizeof(int) * (cmd->output_count + 2);
+   for (param = cmd->param_list; param; param = param->next)
+      bytes += sizeof(param_t) + strlen(param->param) + 1;
+   for (param = cmd->output_list; param; param = param->next)
+      bytes += sizeof(param_t) + strlen(param->param) + 1;
+   for (param = cmd->subst_list; param; param = param->next)
+      bytes += sizeof(param_t) + strlen(param->param) + 1;
+
+   return bytes;
+}
+
+//display the runtime stats
+void
+print_stats(FILE *out)
+{
+   fprintf(out, "   lines read:         %" PRIu64 "\n", stats->lines_read);
+   fprintf(out, "   commands launched:  %" PRIu64 "\n", stats->cmds_launched);
+   fprintf(out, "   forks:              %" PRIu64 "\n", stats->forks);
+   fprintf(out, "   builtins:           %" PRIu64 "\n", stats->builtins);
+   fprintf(out, "   pipe bytes relayed: %" PRIu64 "\n", stats->pipe_bytes);
+   fprintf(out, "   children now/peak:  %" PRIu64 "/%" PRIu64 "\n", stats->children, stats->peak_children);
+   fprintf(out, "   parse heap bytes:   %" PRIu64 "\n", stats->parse_heap_bytes);
+
+   fprintf(out, "   launch latency (usec)  parse time (usec)\n");
+   for (int i = 0; i < STATS_BUCKETS; ++i)
+   {
+      if (!stats->launch_usec[i] && !stats->parse_usec[i]) continue;
+      fprintf(out, "   %s%-6lu %-14" PRIu64 "  %" PRIu64 "\n", (i == STATS_BUCKETS - 1 ? ">=" : "< ")
+              , 1UL << (i == STATS_BUCKETS - 1 ? i - 1 : i)
+              , stats->launch_usec[i], stats->parse_usec[i]);
+   }
+}
+
 //signal handler for SIGINT (ctrl-C).  Forwards SIGINT to child
 //process if it exists, ignores SIGINT if there is no child.
 void
@@ -442,6 +1419,9 @@ free_list(cmd_list_t *cmd_list)
       free_cmd(current);
       current = temp;
    }
+   //and every pipeline after this one on the command line
+   free_list(cmd_list->next);
+   STAT_SUB(parse_heap_bytes, sizeof(cmd_list_t));
    free(cmd_list);
    cmd_list = NULL;
 }
@@ -457,20 +1437,32 @@ print_list(cmd_list_t *cmd_list)
     }
 }
 
+//free a list of params and the strings they hold
+void
+free_params(param_t *param)
+{
+   while (param)
+   {
+      param_t *temp = param->next;
+      if (param->param) free(param->param);
+      free(param);
+      param = temp;
+   }
+}
+
 void
 free_cmd (cmd_t *cmd)
 {
-   param_t *current = NULL;
    if (!cmd) return;
-   current = cmd->param_list;
-
-   while (current) //loop to free the param linked list
+   STAT_SUB(parse_heap_bytes, cmd_heap_bytes(cmd));
+   free_params(cmd->param_list);
+   free_params(cmd->output_list);
+   free_params(cmd->subst_list);
+   if (cmd->output_fds)
    {
-      param_t *temp = current->next;
-      if (current->param) free(current->param);
-      current->param = NULL;
-      free(current);
-      current = temp;
+      for (int i = 0; i < cmd->output_count; ++i)
+         if (cmd->output_fds[i] >= 0) close(cmd->output_fds[i]);
+      free(cmd->output_fds);
    }
    if (cmd->cmd) free(cmd->cmd);
    if (cmd->raw_cmd) free(cmd->raw_cmd);
@@ -513,6 +1505,13 @@ print_cmd(cmd_t *cmd)
             , (NULL == cmd->input_file_name ? "<na>" : cmd->input_file_name));
     fprintf(stderr,"\toutput file name: %s\n"
             , (NULL == cmd->output_file_name ? "<na>" : cmd->output_file_name));
+    if (cmd->output_count > 1 || cmd->output_fds) {
+        fprintf(stderr,"\tfanout to:");
+        for (param = cmd->output_list; param; param = param->next) {
+            fprintf(stderr," %s", param->param);
+        }
+        fprintf(stderr,"%s\n", (cmd->next ? " |" : ""));
+    }
     fprintf(stderr,"\tlocation in list of commands: %d\n", cmd->list_location);
     fprintf(stderr,"\n");
 }
@@ -524,12 +1523,44 @@ print_cmd(cmd_t *cmd)
 // stralloca.
 #define stralloca(_R,_S) {(_R) = alloca(strlen(_S) + 1); strcpy(_R,_S);}
 
-void
+int
 parse_commands(cmd_list_t *cmd_list)
 {
     cmd_t *cmd = cmd_list->head;
     char *arg;
     char *raw;
+    char *parse_heap = NULL;
+    param_t *ptail = NULL;
+    param_t *subst = NULL;
+    int status = 0;
+    uint64_t start = 0;
+    uint64_t heap_before = 0;
+
+    for (cmd = cmd_list->head; cmd; cmd = cmd->next) {
+        heap_before += cmd_heap_bytes(cmd);
+    }
+
+    // Expand command substitutions for every command before any of them
+    // redirect stdin or stdout, so the substituted commands see the
+    // same stdin and stdout as the shell.
+    for (cmd = cmd_list->head; cmd; cmd = cmd->next) {
+        if (strstr(cmd->raw_cmd, STATUS_VAR)) {
+            char *expanded = expand_status(cmd->raw_cmd);
+
+            free(cmd->raw_cmd);
+            cmd->raw_cmd = expanded;
+        }
+        if (strstr(cmd->raw_cmd, SUBST_OPEN)) {
+            char *marked = mark_subst(cmd->raw_cmd, &cmd->subst_list);
+
+            free(cmd->raw_cmd);
+            cmd->raw_cmd = marked;
+        }
+    }
+    cmd = cmd_list->head;
+
+    // The parse time leaves out the substituted commands run above.
+    start = now_usec();
 
     while (cmd) {
         // Because I'm going to be calling strtok() on the string, which does
@@ -543,7 +1574,15 @@ parse_commands(cmd_list_t *cmd_list)
         // Following my comments and trying out alloca() in here. I feel the rush
         // of excitement from the pending doom of alloca(), from a macro even.
         // It's like double exciting.
-        stralloca(raw, cmd->raw_cmd);
+        // A line read with getline() has no upper bound, so the doom is
+        // only tempted when the command fits in a normal command line.
+        if (strlen(cmd->raw_cmd) < MAX_STR_LEN) {
+            stralloca(raw, cmd->raw_cmd);
+        }
+        else {
+            raw = strdup(cmd->raw_cmd);
+            parse_heap = raw;
+        }
 
         arg = strtok(raw, SPACE_DELIM);
         if (NULL == arg) {
@@ -553,19 +1592,29 @@ parse_commands(cmd_list_t *cmd_list)
             // ignore it and move to the next command.
             // No need free with alloca memory.
             //free(raw);
+            free(parse_heap);
+            parse_heap = NULL;
             cmd = cmd->next;
             // I guess I could put everything below in an else block.
             continue;
         }
-        // I put something in here to strip out the single quotes if
-        // they are the first/last characters in arg.
-        if (arg[0] == '\'') {
-            arg++;
+        ptail = NULL;
+        subst = cmd->subst_list;
+        if (strchr(arg, SUBST_MARK)) {
+            // The command itself comes from a command substitution.
+            append_words(cmd, split_subst(arg, &subst), &ptail);
         }
-        if (arg[strlen(arg) - 1] == '\'') {
-            arg[strlen(arg) - 1] = '\0';
+        else {
+            // I put something in here to strip out the single quotes if
+            // they are the first/last characters in arg.
+            if (arg[0] == '\'') {
+                arg++;
+            }
+            if (arg[strlen(arg) - 1] == '\'') {
+                arg[strlen(arg) - 1] = '\0';
+            }
+            cmd->cmd = strdup(arg);
         }
-        cmd->cmd = strdup(arg);
         // Initialize these to the default values.
         cmd->input_src = REDIRECT_NONE;
         cmd->output_dest = REDIRECT_NONE;
@@ -588,17 +1637,25 @@ parse_commands(cmd_list_t *cmd_list)
                 if (cmd->input_src != REDIRECT_NONE || cmd_list->head != cmd)
                 {
                    fprintf(stderr, "improper redirect of input (line %d)\n", __LINE__);
-                   exit(EXIT_FAILURE);
+                   status = -1;
+                   break;
                 }
 
-                cmd->input_file_name = strdup(strtok(NULL, SPACE_DELIM));
+                cmd->input_file_name = subst_file_name(strtok(NULL, SPACE_DELIM), &subst);
+                if (NULL == cmd->input_file_name)
+                {
+                   fprintf(stderr, "improper redirect of input (line %d)\n", __LINE__);
+                   status = -1;
+                   break;
+                }
                 cmd->input_src = REDIRECT_FILE;
 
                 fd = open(cmd->input_file_name, O_RDONLY);
                 if (fd < 0)
                 {
                    fprintf(stderr, "redirect input failed (line %d)\n", __LINE__);
-                   exit(EXIT_FAILURE);
+                   status = -1;
+                   break;
                 }
                 dup2(fd, STDIN_FILENO);
                 close(fd);
@@ -608,38 +1665,64 @@ parse_commands(cmd_list_t *cmd_list)
                 
                 // redirect stdout
                        
-                // If the output_dest is something other than REDIRECT_NONE, then
-                // this is an improper command.
-
-                // If this is anything other than the LAST cmd in the list,
-                // then this is an error.
+                // A second ">", or a ">" on a command that pipes into
+                // the next one, fans the output out to every target.
+                // The files are opened here and hooked up once the whole
+                // command has been seen.
 
+                char *name = subst_file_name(strtok(NULL, SPACE_DELIM), &subst);
+                param_t *file = NULL;
                 int fd;
 
                 //error check
-                if (cmd->output_dest != REDIRECT_NONE || cmd->next != NULL)
+                if (NULL == name)
                 {
                    fprintf(stderr, "improper redirect of output (line %d)\n", __LINE__);
-                   exit(EXIT_FAILURE);
+                   status = -1;
+                   break;
                 }
 
-                cmd->output_file_name = strdup(strtok(NULL, SPACE_DELIM));
-                cmd->output_dest = REDIRECT_FILE;
-
-                fd = open(cmd->output_file_name, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+                fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0600);
                 if (fd < 0)
                 {
                    fprintf(stderr, "redirect output failed (line %d)\n", __LINE__);
-                   exit(EXIT_FAILURE);
+                   free(name);
+                   status = -1;
+                   break;
+                }
+
+                if (NULL == cmd->output_file_name) {
+                    cmd->output_file_name = strdup(name);
+                }
+                cmd->output_dest = REDIRECT_FILE;
+
+                // Keep one spare slot for the pipe to the next command.
+                cmd->output_fds = realloc(cmd->output_fds
+                                          , sizeof(int) * (cmd->output_count + 2));
+                cmd->output_fds[cmd->output_count++] = fd;
+                file = (param_t *) calloc(1, sizeof(param_t));
+                file->param = name;
+                if (NULL == cmd->output_list) {
+                    cmd->output_list = file;
+                }
+                else {
+                    param_t *last = cmd->output_list;
+                    while (last->next != NULL) {
+                        last = last->next;
+                    }
+                    last->next = file;
                 }
-                dup2(fd, STDOUT_FILENO);
-                close(fd);
+            }
+            else if (strchr(arg, SUBST_MARK))
+            {
+                // The words of a command substitution are only ever params,
+                // never redirection or quotes, whatever the output holds.
+                append_words(cmd, split_subst(arg, &subst), &ptail);
             }
             else
             {
                 // add next param
                 param_t *param = (param_t *) calloc(1, sizeof(param_t));
-                param_t *cparam = cmd->param_list;
 
                 cmd->param_count++;
                 // Put something in here to strip out the single quotes if
@@ -651,18 +1734,29 @@ parse_commands(cmd_list_t *cmd_list)
                     arg[strlen(arg) - 1] = '\0';
                 }
                 param->param = strdup(arg);
-                if (NULL == cparam) {
+                if (NULL == ptail) {
                     cmd->param_list = param;
                 }
                 else {
-                    // I should put a tail pointer on this.
-                    while (cparam->next != NULL) {
-                        cparam = cparam->next;
-                    }
-                    cparam->next = param;
+                    // A command substitution can add a lot of params, so
+                    // this keeps a tail pointer instead of walking the list.
+                    ptail->next = param;
                 }
+                ptail = param;
             }
         }
+        if (status < 0) {
+            // A bad redirect. Leave the rest for the caller to free.
+            free(parse_heap);
+            break;
+        }
+        // A single output file on the last command is a plain redirect.
+        if (1 == cmd->output_count && NULL == cmd->next) {
+            dup2(cmd->output_fds[0], STDOUT_FILENO);
+            close(cmd->output_fds[0]);
+            free(cmd->output_fds);
+            cmd->output_fds = NULL;
+        }
         // This could overwite some bogus file redirection.
         if (cmd->list_location > 0) {
             cmd->input_src = REDIRECT_PIPE;
@@ -673,10 +1767,19 @@ parse_commands(cmd_list_t *cmd_list)
 
         // No need free with alloca memory.
         //free(raw);
+        free(parse_heap);
+        parse_heap = NULL;
         cmd = cmd->next;
     }
 
+    for (cmd = cmd_list->head; cmd; cmd = cmd->next) {
+        STAT_ADD(parse_heap_bytes, cmd_heap_bytes(cmd));
+    }
+    STAT_SUB(parse_heap_bytes, heap_before);
+    stats_hist(stats->parse_usec, now_usec() - start);
+
     if (is_verbose > 0) {
         print_list(cmd_list);
     }
+    return status;
 }
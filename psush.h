@@ -4,6 +4,8 @@
 #ifndef _CMD_PARSE_H
 # define _CMD_PARSE_H
 
+# include <stdint.h>
+
 # define MAX_STR_LEN 2000
 
 # define CD_CMD  "cd"
@@ -11,11 +13,19 @@
 # define ECHO_CMD "echo"
 # define BYE_CMD "bye"
 # define HISTORY_CMD "history"
+# define STATS_CMD "stats"
 
 # define PIPE_DELIM  "|"
+# define LIST_DELIMS ";&|"
+# define SEQ_CHAR    ';'
+# define AND_CHAR    '&'
+# define STATUS_VAR  "$?"
 # define SPACE_DELIM " "
 # define REDIR_IN    "<"
 # define REDIR_OUT   ">"
+# define SUBST_OPEN  "$("
+# define SUBST_CLOSE ')'
+# define SUBST_MARK  '\x1f' // stands in for a $( ) in raw_cmd once it has run
 //# define BACKGROUND_CHAR   "&"
 
 # define PROMPT_STR "PSUsh"
@@ -29,6 +39,14 @@ typedef enum {
     , BACKGROUND_PROC
 } redir_t;
 
+// How the pipeline after a cmd_list_t runs, based on its exit status.
+typedef enum {
+    LIST_END
+    , LIST_SEQ // ;  always
+    , LIST_AND // && only on success
+    , LIST_OR  // || only on failure
+} list_op_t;
+
 // A list of param_t elements.
 typedef struct param_s {
     char *param;
@@ -45,6 +63,10 @@ typedef struct cmd_s {
     redir_t output_dest;
     char    *input_file_name;
     char    *output_file_name;
+    param_t *output_list;  // every output file, in command line order
+    int     output_count;
+    int     *output_fds;   // open output files when output is fanned out
+    param_t *subst_list;   // output of each $( ) in raw_cmd, in order
     int     list_location; // zero based
     struct cmd_s *next;
 } cmd_t;
@@ -53,18 +75,75 @@ typedef struct cmd_list_s {
     cmd_t *head;
     cmd_t *tail;
     int count;
+    int tail_exec; // last input of -c or a script, exec in place of the shell
+    list_op_t op;  // connects this pipeline to the next one on the line
+    struct cmd_list_s *next;
 } cmd_list_t;
 
-void parse_commands(cmd_list_t *cmd_list);
+# define STATS_MAGIC   0x70737573 // "psus"
+# define STATS_VERSION 1
+# define STATS_BUCKETS 16
+
+// Runtime counters for the shell. The layout is fixed so a monitor can
+// read it straight out of the file named with -s while the shell runs.
+// Every field is 64 bits and naturally aligned, so reads never tear.
+// Histogram bucket 0 counts times under 1 usec, and bucket i counts
+// times under 2^i usec. The last bucket also holds everything longer.
+typedef struct stats_s {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t lines_read;
+    uint64_t cmds_launched;
+    uint64_t forks;
+    uint64_t builtins;
+    uint64_t pipe_bytes;       // relayed by fanout and command substitution
+    uint64_t children;         // currently running
+    uint64_t peak_children;
+    uint64_t parse_heap_bytes; // in use by cmd_list_t and what it holds
+    uint64_t launch_usec[STATS_BUCKETS];
+    uint64_t parse_usec[STATS_BUCKETS];
+} stats_t;
+
+cmd_list_t *build_cmd_lists(char *line);
+cmd_list_t *build_cmd_list(char *line);
+char *find_delim(char *str, const char *delim);
+int parse_commands(cmd_list_t *cmd_list);
 void free_list(struct cmd_list_s *);
 void print_list(struct cmd_list_s *);
 void free_cmd(struct cmd_s *);
 void print_cmd(struct cmd_s *);
 void exec_commands(cmd_list_t *cmds);
+int is_builtin(const char *name);
+int exec_builtin(cmd_t *cmd, FILE *out);
+int exit_status(int status);
+char *expand_status(const char *raw);
+char *mark_subst(const char *raw, param_t **outputs);
+param_t *split_subst(const char *arg, param_t **subst);
+char *subst_file_name(const char *name, param_t **subst);
+void append_words(cmd_t *cmd, param_t *words, param_t **ptail);
+void free_params(param_t *param);
+char *capture_subst(char *text);
+char *capture_output(cmd_list_t *cmds, int parsed, size_t *len);
+int start_fanout(cmd_list_t *cmds, cmd_t *cmd, int pipe_fd, int in_fd, int peer_fd
+                 , pid_t *relay);
+void fanout_relay(int src, int *fds, int nfds);
+int splice_all(int in, int out, size_t len);
+int write_all(int fd, const char *buf, size_t len);
 int process_user_input_simple(void);
+int run_lists(cmd_list_t *lists);
+void shell_exit(int status);
+int at_end_of_input(FILE *in);
 void simple_argv(int argc, char *argv[]);
 char **make_ragged(cmd_t *cmd);
 void free_ragged(char **argv);
 void signal_handler(int signo);
+void stats_init(const char *path);
+void stats_child(void);
+void stats_forked(uint64_t start);
+void stats_reaped(void);
+void stats_hist(uint64_t *buckets, uint64_t usec);
+uint64_t now_usec(void);
+uint64_t cmd_heap_bytes(cmd_t *cmd);
+void print_stats(FILE *out);
 
 #endif // _CMD_PARSE_H